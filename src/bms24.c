@@ -24,10 +24,13 @@
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include <avr/wdt.h>
+#include <avr/pgmspace.h>
 
 #include "ver.h"
+#include "stackmon.h"
 
 #define BASE_ID 300U // Starting ID used for BMS module messaging to/from EVMS
+#define BROADCAST_ID (BASE_ID - 1U) // Request accepted by all modules
 
 // CAN message types
 // cppcheck-suppress [misra-c2012-2.4] checker is confused here
@@ -38,15 +41,117 @@ enum {
     BMS12_REPLY3,
     BMS12_REPLY4,
     CMD_ID,
-    RESP_ID
+    RESP_ID,
+    SCOPE_ID
 };
 
+// Alarm messages use a low ID so they win bus arbitration over other traffic.
+// There is one alarm ID per module: ALARM_BASE_ID + rotary switch
+#define ALARM_BASE_ID 200U
+
+// alarm types
+#define ALARM_OVER_VOLTAGE  1u
+#define ALARM_UNDER_VOLTAGE 2u
+#define ALARM_OVER_TEMP     3u
+
 // values for command types
 #define CMD_REBOOT 0u
 #define CMD_VERSION 1u
+#define CMD_STATS 2u
+#define CMD_HISTORY 3u
+#define CMD_STATS_CLEAR 4u
+#define CMD_SET_LIMITS 5u
+#define CMD_MEMORY 6u
+#define CMD_CAN_STATUS 7u
+#define CMD_SAMPLE_RATE 8u
+#define CMD_SCOPE 9u
+#define CMD_BALANCE 10u
+#define CMD_BALANCE_CLEAR 11u
 
 #define COMMS_TIMEOUT   32u // at 32Hz, i.e 1 second timeout
 
+// CAN timer is used to time the broadcast reply slots and the main loop
+// timer clock is 8MHz / (8 * (CANTCON + 1)), so 50kHz or 20us per tick.
+// It wraps after 1.3 seconds, which is longer than the last reply slot.
+#define CANTIM_PRESCALE     19u
+#define CANTIM_TICKS_PER_MS 50u
+
+// Broadcast reply slots. Each module waits BCAST_GUARD_MS after the broadcast
+// request so that every module has reached the reply check in its main loop,
+// then replies in a slot of BCAST_SLOT_MS according to its rotary switch.
+// A slot holds both groups of replies: 8 frames, the 7ms of intermissions
+// between them, and 2ms of margin. A frame with 8 data bytes is at most about
+// 160 bits with bit stuffing, so the slot is wider at lower baud rates.
+// A module that is too late for its slot uses the same slot in a second round,
+// after the slots of all BCAST_SLOTS rotary switch settings.
+#define BCAST_GUARD_MS  40u
+#define BCAST_SLOTS     16u
+#define CAN_FRAME_US    ((160UL * 1000UL) / CAN_BAUD_RATE)
+#define BCAST_SLOT_MS   ((uint16_t)((((8UL * CAN_FRAME_US) + 999UL) / 1000UL) + 7UL + 2UL))
+// Worst case of one pass through the main loop while a broadcast reply is
+// waiting. Other replies and scope capture wait until the broadcast reply is
+// sent, so this is the LTC comms (27ms), the idle time (4ms), the alarm
+// messages (2 frames, up to 6ms each if they time out) and the slow loop.
+#define LOOP_PERIOD_MS  48u
+
+// Adaptive sample rate
+// The main loop runs at BASE_RATE_HZ, and cells are sampled every sampleDiv
+// passes. The fastest rate is limited by the time to talk to the LTCs.
+#define BASE_RATE_HZ        32u
+#define LTC_CYCLE_MS        27u // time for LTC comms when sampling
+#define RATE_DIV_MAX        8u  // slowest is 4Hz, well inside LTC watchdog
+#define RATE_FAST_MV        8u  // cell change per slow loop to go fast
+#define RATE_REST_MV        3u  // cell change per slow loop to be at rest
+#define RATE_REST_LOOPS     8u  // slow loops at rest before slowing down
+#define AVG_SAMPLES_FAST    4u  // most samples to average when moving fast
+#define AVG_SAMPLES_REST    8u  // samples to average when not moving fast
+
+// Scope capture
+// Scope messages are limited per sample so that one pass through the main
+// loop stays inside the 120ms watchdog time. If every message times out
+// (about 3.5ms each), the worst pass is the LTC comms (27ms), 2 alarms (7ms),
+// the scope messages (7ms), and the longest reply sequence, 13 messages with
+// 1ms gaps (58ms). With the slow loop that is about 100ms.
+#define SCOPE_MAX_FRAMES    2u  // 3 cells of one unit per message
+
+// Balancing
+// balance (shunt) resistance for each cell, used to estimate bleed charge.
+// It is a build setting (see the Makefile) so it can be set to match the
+// resistors fitted to the board. The default of 27 ohms is not from a BOM.
+#ifndef SHUNT_OHMS
+#define SHUNT_OHMS          27u
+#endif
+#define SLOW_LOOPS_PER_SEC  4u  // slow loop is about 4Hz
+// slow loops per 0.1 mAh at 1 mA: 3600 * 4 / 10
+#define SLOW_LOOPS_PER_01MAH 1440u
+
+// CAN transmit and bus error handling
+// A frame takes about 0.3ms at 500k, so this allows for several frames of
+// higher priority traffic. It must stay short enough that a burst of replies
+// that all time out does not trip the watchdog. The timeout is counted in
+// polls of CAN_TX_POLL_US rather than with the CAN timer, because the CAN
+// timer stops when the CAN controller is not enabled.
+#define CAN_TX_TIMEOUT_MS   3u
+#define CAN_TX_POLL_US      10u
+#define CAN_TX_POLLS        ((CAN_TX_TIMEOUT_MS * 1000u) / CAN_TX_POLL_US)
+#define CAN_BUSOFF_HOLDOFF  32u // main loops (about 1 sec) before recovering
+
+// Cell statistics
+// cell voltages outside these limits are counted by the slow loop
+#define DEFAULT_OVER_MV     4200u
+#define DEFAULT_UNDER_MV    2800u
+// history snapshot is taken with the first average at least HISTORY_INTERVAL
+// slow loops (about 2 sec) after the last one
+#define HISTORY_INTERVAL    8u
+#define HISTORY_DEPTH       8u
+
+// Alarms
+// an alarm is cleared once the value is back inside the limit by this much
+#define ALARM_HYST_MV       20u
+#define ALARM_HYST_TEMP     2u
+#define DEFAULT_OVER_TEMP   100u // 60 deg C, with 40 deg C offset
+#define ALARM_MAX_PER_LOOP  2u  // limit alarm messages per sample period
+
 // SPI interface pins
 #define CSBI        (1<<PC5)
 #define CSBI_PORT   PORTC
@@ -88,26 +193,135 @@ enum {
 
 // Function declarations
 static void SetupPorts(void);
+static void SampleCells(uint32_t shuntBits);
+static uint16_t CorrectVoltage(uint8_t cell, uint16_t mv);
+static void CanInit(void);
+static void CanCheckBus(void);
+static void UpdateSampleRate(uint16_t maxDelta);
+static void SetSampleRate(void);
+static uint16_t SetScope(uint16_t group);
+static void SendScope(const uint16_t cells[24]);
+static void UpdateBalance(uint32_t shuntBits);
+static void ClearBalance(uint16_t group);
+static void SendBalance(uint16_t group);
 static int LineariseTemp(uint16_t adc);
-static void CanTX(uint32_t packetID, uint8_t bytes);
+static bool CanTX(uint32_t packetID, uint8_t bytes);
 static void WriteSPIByte(uint8_t byte);
 static uint8_t ReadSPIByte(void);
 static void WriteSPIByte2(uint8_t byte);
 static uint8_t ReadSPIByte2(void);
 static void GetModuleID(void);
+static void SendCellData(uint16_t group);
+static bool BroadcastSlotReady(uint16_t passTicks);
+static void UpdateStats(uint8_t loops);
+static void UpdateCellCounts(uint8_t cell, uint16_t mv);
+static void ClearStats(uint16_t group);
+static void SendStats(uint16_t group);
+static void SendHistory(uint16_t group);
+static void SetLimits(void);
+static void CheckAlarms(const uint16_t cells[24], const uint16_t temps[4]);
+static bool SendAlarm(uint8_t type, uint8_t index, uint16_t value, bool active);
 
 // Global variables
 static uint8_t txData[8]; // CAN transmit buffer
 static volatile bool dataRequestedL = false; // Low group, LTC #2
 static volatile bool dataRequestedH = false; // High group, LTC #1
+static volatile bool broadcastRequested = false; // Both groups, in time slot
+static volatile uint16_t broadcastStamp; // CAN timer when broadcast received
 static volatile bool version_request = false;
 static volatile bool reboot_request = false;
+static volatile bool stats_request = false;
+static volatile bool history_request = false;
+static volatile bool stats_clear_request = false;
+static volatile bool set_limits_request = false;
+static volatile bool memory_request = false;
+static volatile bool can_status_request = false;
+static volatile bool sample_rate_request = false;
+static volatile bool scope_request = false;
+static volatile bool balance_request = false;
+static volatile bool balance_clear_request = false;
+static volatile uint8_t cmdData[7]; // data bytes that follow command type
 static volatile uint8_t last_request_id;
 
 static uint16_t moduleID = 0;
 
 static volatile uint16_t shuntVoltage; // In millivolts
 
+static uint16_t voltage[24]; // In millivolts
+static int16_t temp[4]; // In deg C
+
+// Sums of the samples since the last average. The cell sums are of half the
+// sample, like the original averaging, so they cannot overflow. There are at
+// most AVG_SAMPLES_REST - 1 + 8 samples before an average is taken.
+static uint16_t cellSum[24];
+static uint16_t tempSum[4];
+static uint8_t sampleCount = 0;
+
+// Cell statistics, since reset or since cleared by command
+// The sample counts and history are kept per unit (group), where group 0 is
+// cells 1-12 and group 1 is cells 13-24. The history records which cell was
+// lowest and highest. Per cell, there is a count of the times the cell went
+// over or under the limit, which is 8 bits to save RAM.
+typedef struct
+{
+    uint16_t min;   // lowest cell voltage in the unit
+    uint16_t max;   // highest cell voltage in the unit
+    uint8_t minCell; // cell number in the unit, 1-12, or 0 if no cells
+    uint8_t maxCell;
+} snapshot_t;
+
+static uint16_t cellMin[24]; // In millivolts
+static uint16_t cellMax[24];
+static uint16_t overCount[2]; // count of slow loop samples over/under limit
+static uint16_t underCount[2];
+static uint8_t cellOverCount[24]; // times each cell went over/under limit
+static uint8_t cellUnderCount[24];
+static uint32_t cellsOver = 0; // cells now over/under limit, with hysteresis
+static uint32_t cellsUnder = 0;
+static uint16_t cellOverLimit = DEFAULT_OVER_MV;
+static uint16_t cellUnderLimit = DEFAULT_UNDER_MV;
+static snapshot_t history[2][HISTORY_DEPTH]; // ring buffer of snapshots
+static uint8_t historyCount[2]; // number of valid snapshots
+static uint8_t historyHead = 0; // next snapshot to write
+
+// Alarm state. Each bit is set while that cell or temp sensor is in alarm
+static bool alarmsEnabled = false;
+static uint8_t overTempLimit = DEFAULT_OVER_TEMP; // deg C, 40 deg C offset
+static uint32_t overVoltAlarms = 0;
+static uint32_t underVoltAlarms = 0;
+static uint8_t overTempAlarms = 0;
+static uint8_t alarmsSent; // number sent in this sample period
+
+// Sample rate state. Start at the fastest rate, averaging every slow loop,
+// until the cells are seen to be at rest.
+static uint8_t sampleDiv = 1; // sample every this many main loops
+static bool fastAveraging = true; // average every slow loop
+static uint8_t avgSamples = 0; // samples in the last average
+static uint8_t rateDivFast = 1; // configured fastest and slowest rate
+static uint8_t rateDivSlow = RATE_DIV_MAX;
+static uint16_t cellDeltaMax = 0; // fastest cell change in last slow loop
+
+// Scope capture state. Raw samples of the selected cells are sent until
+// the timer (in main loops) runs out.
+static uint32_t scopeCells = 0; // each bit selects a cell
+static uint16_t scopeTimer = 0;
+static uint8_t scopeSeq = 0; // sequence number of sample
+
+// Balancing counters, per cell and per group (unit). The shunts are checked
+// every slow loop, and the on time is kept as whole seconds plus the slow
+// loops left over. The times are 16 bits to save RAM, and saturate after
+// about 18 hours.
+static uint16_t shuntSecs[24]; // seconds with shunt on
+static uint8_t shuntLoops[24]; // slow loops with shunt on, less than 1 second
+static uint32_t shuntMVLoops[24]; // cell mV summed each slow loop shunt is on
+static uint16_t balanceSecs[2]; // seconds since cleared
+
+// CAN bus state and counters
+static bool canBusOff = false;
+static uint8_t canBusOffCount = 0; // saturates at 255
+static uint8_t canErrPassiveCount = 0; // saturates at 255
+static uint16_t canDropped = 0; // frames not sent, saturates at 65535
+
 // cppcheck-suppress [misra-c2012-2.7,misra-c2012-8.2,misra-c2012-8.4]
 ISR(CAN_INT_vect) // Interrupt function when a new CAN message is received
 {
@@ -138,7 +352,13 @@ ISR(CAN_INT_vect) // Interrupt function when a new CAN message is received
         }
 
         // Data request message
-        if (rxPacketID == moduleID) // Request is for us
+        if (rxPacketID == BROADCAST_ID) // Request is for all modules
+        {
+            shuntVoltage = (rxData[0] << 8) + rxData[1];
+            broadcastStamp = CANSTMP; // time stamp of this message
+            broadcastRequested = true;
+        }
+        else if (rxPacketID == moduleID) // Request is for us
         {
             shuntVoltage = (rxData[0]<<8) + rxData[1]; // Big endian format (high byte first)
             dataRequestedL = true;
@@ -154,6 +374,10 @@ ISR(CAN_INT_vect) // Interrupt function when a new CAN message is received
               || (rxPacketID == (moduleID + 10u + CMD_ID)))
         {
             uint8_t cmd = rxData[0];    // get the command type
+            for (int8_t i = 1; i < 8; i++) // save remaining data for command
+            {
+                cmdData[i - 1] = (i < length) ? rxData[i] : 0u;
+            }
             if (cmd == CMD_REBOOT)
             {
                 reboot_request = true;
@@ -162,6 +386,46 @@ ISR(CAN_INT_vect) // Interrupt function when a new CAN message is received
             {
                 version_request = true;
             }
+            else if (cmd == CMD_STATS)
+            {
+                stats_request = true;
+            }
+            else if (cmd == CMD_HISTORY)
+            {
+                history_request = true;
+            }
+            else if (cmd == CMD_STATS_CLEAR)
+            {
+                stats_clear_request = true;
+            }
+            else if (cmd == CMD_SET_LIMITS)
+            {
+                set_limits_request = true;
+            }
+            else if (cmd == CMD_MEMORY)
+            {
+                memory_request = true;
+            }
+            else if (cmd == CMD_CAN_STATUS)
+            {
+                can_status_request = true;
+            }
+            else if (cmd == CMD_SAMPLE_RATE)
+            {
+                sample_rate_request = true;
+            }
+            else if (cmd == CMD_SCOPE)
+            {
+                scope_request = true;
+            }
+            else if (cmd == CMD_BALANCE)
+            {
+                balance_request = true;
+            }
+            else if (cmd == CMD_BALANCE_CLEAR)
+            {
+                balance_clear_request = true;
+            }
             else { /* unknown command */ }
 
             // remember which unit received the command
@@ -183,8 +447,6 @@ ISR(CAN_INT_vect) // Interrupt function when a new CAN message is received
 
 int main(void)
 {
-    static uint16_t voltage[24]; // In millivolts
-    static int16_t temp[4]; // In deg C
     uint32_t shuntBits = 0;
     uint8_t commsTimer = 0;
 
@@ -197,148 +459,44 @@ int main(void)
     // Initialising variables
     (void)memset(voltage, 0, sizeof(voltage));
     (void)memset(temp, 0, sizeof(temp));
+    ClearStats(0);
+    ClearStats(1u);
+    ClearBalance(0);
+    ClearBalance(1u);
 
     sei(); // Enable interrupts
     wdt_enable(WDTO_120MS); // Enable watchdog timer
 
-    uint8_t cellBytes[2][25];
-    uint8_t tempBytes[2][5];
-    uint16_t voltages[24][8];
-    uint16_t tempBuffer[4][8];
-
     uint8_t counter = 0;
     uint8_t slowCounter = 0;
+    uint8_t sampleTimer = 0;
+    uint8_t loopsSinceAverage = 0;
+    uint16_t passStart = CANTIM;
+    uint16_t passTicks = 0;
     while (1)
     {
         wdt_reset();
 
-        // Comms with LTC6802s..
-        // Split up the 32-bit shuntBits variable into two 12-bit chunks for each LTC
-        uint32_t shuntBitsL = shuntBits & 0x0FFFu; // Lower 12 bits
-        uint32_t shuntBitsH = shuntBits >> 12; // Upper 12 bits
-
-        // Write config registers, LTC #1, which is the left side (more positive)
-        CSBI_PORT &= ~CSBI; // Pull down to start command
-        WriteSPIByte(WRCFG); // write configuration group
-        WriteSPIByte(0b00000001);
-        WriteSPIByte(((unsigned short)(shuntBitsH & 0x00FFu))); // Bottom byte of shunt bits
-        WriteSPIByte(((unsigned short)(shuntBitsH >> 8))); // Top four bits of shunt bits, right shifted 1 byte
-        WriteSPIByte(0b00000000);
-        WriteSPIByte(0b00000000);
-        WriteSPIByte(0b00000000);
-        CSBI_PORT |= CSBI; // Pull up to end command
-        _delay_us(100);
-
-        // Start voltage sampling
-        CSBI_PORT &= ~CSBI;
-        WriteSPIByte(STCVAD);
-        CSBI_PORT |= CSBI;
-
-        // Write config registers, LTC #2, which is the right side (more negative)
-        CSBI2_PORT &= ~CSBI2; // Pull down to start command
-        WriteSPIByte2(WRCFG); // write configuration group
-        WriteSPIByte2(0b00000001);
-        WriteSPIByte2(((uint16_t)(shuntBitsL & 0x00FFu))); // Bottom byte of shunt bits
-        WriteSPIByte2(((uint16_t)(shuntBitsL >> 8))); // Top four bits of shunt bits, right shifted 1 byte
-        WriteSPIByte2(0b00000000);
-        WriteSPIByte2(0b00000000);
-        WriteSPIByte2(0b00000000);
-        CSBI2_PORT |= CSBI2; // Pull up to end command
-        _delay_us(100);
-
-        // Start voltage sampling
-        CSBI2_PORT &= ~CSBI2;
-        WriteSPIByte2(STCVAD);
-        CSBI2_PORT |= CSBI2;
-
-        _delay_ms(20); // Cell sampling can take up to 16ms - anything we need to do in the meantime? Not really.
-
-        // Start temperature sampling
-        CSBI_PORT &= ~CSBI;
-        WriteSPIByte(STTMPAD);
-        CSBI_PORT |= CSBI;
-
-        // Start temperature sampling, ltc #2
-        CSBI2_PORT &= ~CSBI2;
-        WriteSPIByte2(STTMPAD);
-        CSBI2_PORT |= CSBI2;
-
-        _delay_ms(5); // Temp sampling should only take ~3ms
-
-        // Read cell voltage registers
-        CSBI_PORT &= ~CSBI;
-        WriteSPIByte(RDCV);
-        SDI_PORT |= SDI;
-        for (uint8_t n = 0; n < 25u; n++)
-        {
-            cellBytes[0][n] = ReadSPIByte();
-        }
-        CSBI_PORT |= CSBI;
-        _delay_us(100);
-
-        // Read temperature data
-        CSBI_PORT &= ~CSBI;
-        WriteSPIByte(RDTMP);
-        SDI_PORT |= SDI;
-        for (uint8_t n = 0; n < 5u; n++)
-        {
-            tempBytes[0][n] = ReadSPIByte();
-        }
-        CSBI_PORT |= CSBI;
-        _delay_us(100);
-
-        // Read cell voltage registers, ltc #2
-        CSBI2_PORT &= ~CSBI2;
-        WriteSPIByte2(RDCV);
-        SDI2_PORT |= SDI2;
-        for (uint8_t n = 0; n < 25u; n++)
-        {
-            cellBytes[1][n] = ReadSPIByte2();
-        }
-        CSBI2_PORT |= CSBI2;
-        _delay_us(100);
-
-        // Read temperature data, ltc #2
-        CSBI2_PORT &= ~CSBI2;
-        WriteSPIByte2(RDTMP);
-        SDI2_PORT |= SDI2;
-        for (uint8_t n = 0; n < 5u; n++)
-        {
-            tempBytes[1][n] = ReadSPIByte2();
-        }
-        CSBI2_PORT |= CSBI2;
-        _delay_us(100);
-
-        // Extract voltage data
-        for (uint8_t n = 0; n < 12u; n += 2u)
-        {
-            uint16_t v = cellBytes[1][(n * 3u) / 2u]; // lower byte
-            v += (cellBytes[1][((n * 3u) / 2u) + 1u] & 0x0Fu) << 8; // upper 4 bits
-            v = (v * 3u) / 2u; // mV conversion
-            voltages[n][counter] = v;
-            v = (cellBytes[1][((n * 3u) / 2u) + 1u]) >> 4; // lower 4 bits of next cell
-            v += cellBytes[1][((n * 3u) / 2u) + 2u] << 4;  // upper 8 bits
-            v = (v * 3u) / 2u;
-            voltages[n + 1u][counter] = v;
-        }
-        for (uint8_t n = 0; n < 12u; n += 2u)
-        {
-            uint16_t v = cellBytes[0][(n * 3u) / 2u]; // lower byte
-            v += (cellBytes[0][((n * 3u) / 2u) + 1u] & 0x0Fu) << 8; // upper 4 bits
-            v = (v * 3u) / 2u; // mV conversion
-            voltages[n + 12u][counter] = v;
-            v = (cellBytes[0][((n * 3u) / 2u) + 1u]) >> 4; // lower 4 bits of next cell
-            v += cellBytes[0][((n * 3u) / 2u) + 2u] << 4;  // upper 8 bits
-            v = (v * 3u) / 2u;
-            voltages[n + 12u + 1u][counter] = v;
-        }
-
-        // Extract temperature data
-        tempBuffer[0][counter] = tempBytes[1][0] + (256u * (tempBytes[1][1] & 0x0Fu)); // gives mV
-        tempBuffer[1][counter] = ((uint8_t)(tempBytes[1][1] & 0xF0u) >> 4)
-                               + (tempBytes[1][2] * 16u); // gives mV
-        tempBuffer[2][counter] = tempBytes[0][0] + (256u * (tempBytes[0][1] & 0x0Fu)); // gives mV
-        tempBuffer[3][counter] = ((tempBytes[0][1] & 0xF0u) >> 4) + (tempBytes[0][2] * 16u); // gives mV
+        // Measure the last pass through the main loop, in CAN timer ticks.
+        // This is used to predict if the next pass will reach the broadcast
+        // reply check in time for this module's slot.
+        uint16_t passNow = CANTIM;
+        passTicks = passNow - passStart;
+        passStart = passNow;
+
+        // Sample the cells at the current sample rate. The main loop always
+        // runs at about 32Hz, and ticks that do not sample just wait for
+        // the same amount of time the LTC comms would have taken.
+        sampleTimer++;
+        if (sampleTimer >= sampleDiv)
+        {
+            sampleTimer = 0;
+            SampleCells(shuntBits);
+        }
+        else
+        {
+            _delay_ms(LTC_CYCLE_MS);
+        }
 
         counter++;
         if (counter >= 8u) // Slow loop, about 4Hz
@@ -352,32 +510,36 @@ int main(void)
             }
 
             bool notAllZeroVolts = false;
-            for (uint8_t n = 0; n < 24u; n++) // Calculate average voltage over last 8 samples, and update shunts if required
+            uint16_t maxDelta = 0;
+
+            // While cells are moving fast there is a new average every slow
+            // loop. Otherwise samples are collected over several slow loops
+            // until there are enough for a longer average.
+            loopsSinceAverage++;
+            bool newAverage = (sampleCount != 0u)
+                           && (fastAveraging || (sampleCount >= AVG_SAMPLES_REST));
+
+            for (uint8_t n = 0; n < 24u; n++) // Calculate average voltage over the samples, and update shunts if required
             {
-                uint16_t average = 0;
-                for (uint8_t c = 0; c < 8u; c++)
+                if (newAverage)
                 {
-                    average += voltages[n][c] / 2u;
-                }
-                voltage[n] = average >> 2;
+                    uint16_t prev = voltage[n];
+                    voltage[n] = ((uint32_t)cellSum[n] * 2u) / sampleCount;
+                    cellSum[n] = 0;
 
-                uint16_t correction = LOW_LTC_CORRECTION;
-                if (n >= 12u)
-                {
-                    correction = HIGH_LTC_CORRECTION;
-                }
-                if (voltage[n] > 0u)
-                {
-                    voltage[n] += correction;
-                    if ((n == 0u) || (n == 12u))
+                    voltage[n] = CorrectVoltage(n, voltage[n]);
+
+                    if (voltage[n] > 5000u) // Probably means no cells are plugged in to power the LTC
                     {
-                        voltage[n] -= correction / 2u; // First cells have less drop due to single 3.3Kohm resistor in play
+                        voltage[n] = 0;
                     }
-                }
 
-                if (voltage[n] > 5000u) // Probably means no cells are plugged in to power the LTC
-                {
-                    voltage[n] = 0;
+                    // track the fastest changing cell
+                    uint16_t delta = (voltage[n] > prev) ? (voltage[n] - prev) : (prev - voltage[n]);
+                    if (delta > maxDelta)
+                    {
+                        maxDelta = delta;
+                    }
                 }
 
                 if (voltage[n] > 0u)
@@ -395,15 +557,23 @@ int main(void)
                 }
             }
 
-            // Calculate temperature averages
-            for (uint8_t n = 0; n < 4u; n++)
+            UpdateBalance(shuntBits);
+
+            if (newAverage)
             {
-                uint16_t average = 0;
-                for (uint8_t c = 0; c < 8u; c++)
+                UpdateStats(loopsSinceAverage);
+
+                // Calculate temperature averages
+                for (uint8_t n = 0; n < 4u; n++)
                 {
-                    average += tempBuffer[n][c];
+                    temp[n] = tempSum[n] / sampleCount;
+                    tempSum[n] = 0;
                 }
-                temp[n] = average >> 3;
+
+                avgSamples = sampleCount;
+                sampleCount = 0;
+                UpdateSampleRate(maxDelta / loopsSinceAverage); // change per slow loop
+                loopsSinceAverage = 0;
             }
 
             // Update Status LED(s)
@@ -430,6 +600,15 @@ int main(void)
             {} // there is comms so it will stay green
         }
 
+        if (scopeTimer != 0u)
+        {
+            scopeTimer--;
+            if (scopeTimer == 0u)
+            {
+                scopeCells = 0; // capture is done
+            }
+        }
+
         if (commsTimer < COMMS_TIMEOUT)
         {
             commsTimer++;
@@ -439,61 +618,40 @@ int main(void)
             shuntVoltage = 0; // If comms times out, kill all shunt balancers just to be safe
         }
 
-        if (dataRequestedL)
+        if (broadcastRequested)
         {
-            dataRequestedL = false;
-            commsTimer = 0;
-
-            // Voltage packets
-            // the compiler produces more efficient code when loop indexes
-            // here are uint16_t instead of uint8_t, for some reason
-            for (uint16_t packet = 0; packet < 3u; packet++)
+            // All other replies wait until the broadcast reply is sent, so
+            // that a pass does not take long enough to miss the slot
+            if (BroadcastSlotReady(passTicks))
             {
-                for (uint16_t n = 0; n < 4u; n++)
-                {
-                    txData[n * 2u] = voltage[(packet * 4u) + n] >> 8; // Top 8 bits
-                    txData[(n * 2u) + 1u] = voltage[(packet * 4u) + n] & 0xFFu; // Bottom 8 bits
-                }
-                CanTX(moduleID + packet + 1u, 8);
-                _delay_ms(1); // Brief intermission between packets?
+                broadcastRequested = false;
+                commsTimer = 0;
+                SendCellData(0);
+                _delay_ms(1);
+                SendCellData(1u);
+            }
+            else
+            {
+                _delay_ms(4);
             }
-
-            // Temperature packet
-            (void)memset(txData, 0, sizeof(txData)); // zero out unused
-            txData[0] = LineariseTemp(temp[0]);
-            txData[1] = LineariseTemp(temp[1]);
-            CanTX(moduleID + BMS12_REPLY4, 8);
-
+        }
+        else if (dataRequestedL)
+        {
+            dataRequestedL = false;
+            commsTimer = 0;
+            SendCellData(0);
         }
         else if (dataRequestedH)
         {
             dataRequestedH = false;
             commsTimer = 0;
-
-            // Voltage packets
-            for (uint16_t packet = 0; packet < 3u; packet++)
-            {
-                for (uint16_t n = 0; n < 4u; n++)
-                {
-                    txData[n * 2u] = voltage[12u + (packet * 4u) + n] >> 8; // Top 8 bits
-                    txData[(n * 2u) + 1u] = voltage[12u + (packet * 4u) + n] & 0xFFu; // Bottom 8 bits
-                }
-                CanTX(moduleID + 10u + packet + 1u, 8);
-                _delay_ms(1); // Brief intermission between packets?
-            }
-
-            // Temperature packet
-            (void)memset(txData, 0, sizeof(txData)); // zero out unused
-            txData[0] = LineariseTemp(temp[2]);
-            txData[1] = LineariseTemp(temp[3]);
-            CanTX(moduleID + 10u + BMS12_REPLY4, 8);
-
+            SendCellData(1u);
         }
         else if (reboot_request)
         {
             reboot_request = false;
             txData[0] = CMD_REBOOT;     // ack for reboot request
-            CanTX(moduleID + last_request_id + RESP_ID, 1);
+            (void)CanTX(moduleID + last_request_id + RESP_ID, 1);
             for(;;)
             {}  // allow watchdog to time out causing reset
         }
@@ -504,52 +662,1056 @@ int main(void)
             txData[1] = g_version[0];   // load payload with version bytes
             txData[2] = g_version[1];
             txData[3] = g_version[2];
-            CanTX(moduleID + last_request_id + RESP_ID, 4); // send response
+            (void)CanTX(moduleID + last_request_id + RESP_ID, 4); // send response
+        }
+        else if (stats_request)
+        {
+            stats_request = false;
+            SendStats(last_request_id / 10u);
+        }
+        else if (history_request)
+        {
+            history_request = false;
+            SendHistory(last_request_id / 10u);
+        }
+        else if (stats_clear_request)
+        {
+            stats_clear_request = false;
+            ClearStats(last_request_id / 10u);
+            txData[0] = CMD_STATS_CLEAR;    // ack for clear request
+            (void)CanTX(moduleID + last_request_id + RESP_ID, 1);
+        }
+        else if (set_limits_request)
+        {
+            set_limits_request = false;
+            SetLimits();
+            txData[0] = CMD_SET_LIMITS;     // ack for set limits request
+            (void)CanTX(moduleID + last_request_id + RESP_ID, 1);
+        }
+        else if (memory_request)
+        {
+            memory_request = false;
+            uint16_t staticSize = StackMonStaticSize();
+            uint16_t stackDepth = StackMonMaxDepth();
+            uint16_t unused = StackMonUnused();
+            txData[0] = CMD_MEMORY;
+            txData[1] = staticSize >> 8;
+            txData[2] = staticSize & 0xFFu;
+            txData[3] = stackDepth >> 8;
+            txData[4] = stackDepth & 0xFFu;
+            txData[5] = unused >> 8;
+            txData[6] = unused & 0xFFu;
+            (void)CanTX(moduleID + last_request_id + RESP_ID, 7);
+        }
+        else if (can_status_request)
+        {
+            can_status_request = false;
+            txData[0] = CMD_CAN_STATUS;
+            txData[1] = CANTEC; // transmit error counter
+            txData[2] = CANREC; // receive error counter
+            txData[3] = CANGSTA;
+            txData[4] = canBusOffCount;
+            txData[5] = canDropped >> 8;
+            txData[6] = canDropped & 0xFFu;
+            txData[7] = canErrPassiveCount;
+            (void)CanTX(moduleID + last_request_id + RESP_ID, 8);
+        }
+        else if (sample_rate_request)
+        {
+            sample_rate_request = false;
+            SetSampleRate();
+            uint16_t dvdt = cellDeltaMax * 4u; // slow loop is about 4Hz
+            txData[0] = CMD_SAMPLE_RATE;
+            txData[1] = BASE_RATE_HZ / sampleDiv;
+            txData[2] = avgSamples;
+            txData[3] = BASE_RATE_HZ / rateDivFast;
+            txData[4] = BASE_RATE_HZ / rateDivSlow;
+            txData[5] = dvdt >> 8;
+            txData[6] = dvdt & 0xFFu;
+            (void)CanTX(moduleID + last_request_id + RESP_ID, 7);
+        }
+        else if (scope_request)
+        {
+            scope_request = false;
+            uint16_t accepted = SetScope(last_request_id / 10u);
+            txData[0] = CMD_SCOPE;          // ack for scope request
+            txData[1] = accepted >> 8;      // with the cells that will be sent
+            txData[2] = accepted & 0xFFu;
+            (void)CanTX(moduleID + last_request_id + RESP_ID, 3);
+        }
+        else if (balance_request)
+        {
+            balance_request = false;
+            SendBalance(last_request_id / 10u);
+        }
+        else if (balance_clear_request)
+        {
+            balance_clear_request = false;
+            ClearBalance(last_request_id / 10u);
+            txData[0] = CMD_BALANCE_CLEAR;  // ack for clear request
+            (void)CanTX(moduleID + last_request_id + RESP_ID, 1);
         }
         else
         {
             _delay_ms(4); // Talking to LTC takes 27ms, so this makes it 31ms, which inverts to about 32Hz. Accuracy not important.
         }
 
+        CanCheckBus();
         GetModuleID(); // Update in case it changed at runtime
     }
 }
 
-void CanTX(uint32_t packetID, uint8_t bytes)
+// Sample all the cells and temperature sensors once. This also writes the
+// shunt bits to the LTCs. Each sample is added to the sums used by the slow
+// loop for averaging, and is checked for alarms and scope capture.
+void SampleCells(uint32_t shuntBits)
 {
-    CANPAGE = 0x00; // Select MOB0 for transmission
-    while ((CANEN2 & (1 << ENMOB0)) != 0)
-    {} // Wait for MOB0 to be free
-    CANSTMOB = 0x00;
+    uint8_t cellBytes[2][25];
+    uint8_t tempBytes[2][5];
+    uint16_t cells[24]; // In millivolts, before correction
+    uint16_t temps[4]; // In millivolts
+
+    // Comms with LTC6802s..
+    // Split up the 32-bit shuntBits variable into two 12-bit chunks for each LTC
+    uint32_t shuntBitsL = shuntBits & 0x0FFFu; // Lower 12 bits
+    uint32_t shuntBitsH = shuntBits >> 12; // Upper 12 bits
+
+    // Write config registers, LTC #1, which is the left side (more positive)
+    CSBI_PORT &= ~CSBI; // Pull down to start command
+    WriteSPIByte(WRCFG); // write configuration group
+    WriteSPIByte(0b00000001);
+    WriteSPIByte(((unsigned short)(shuntBitsH & 0x00FFu))); // Bottom byte of shunt bits
+    WriteSPIByte(((unsigned short)(shuntBitsH >> 8))); // Top four bits of shunt bits, right shifted 1 byte
+    WriteSPIByte(0b00000000);
+    WriteSPIByte(0b00000000);
+    WriteSPIByte(0b00000000);
+    CSBI_PORT |= CSBI; // Pull up to end command
+    _delay_us(100);
+
+    // Start voltage sampling
+    CSBI_PORT &= ~CSBI;
+    WriteSPIByte(STCVAD);
+    CSBI_PORT |= CSBI;
+
+    // Write config registers, LTC #2, which is the right side (more negative)
+    CSBI2_PORT &= ~CSBI2; // Pull down to start command
+    WriteSPIByte2(WRCFG); // write configuration group
+    WriteSPIByte2(0b00000001);
+    WriteSPIByte2(((uint16_t)(shuntBitsL & 0x00FFu))); // Bottom byte of shunt bits
+    WriteSPIByte2(((uint16_t)(shuntBitsL >> 8))); // Top four bits of shunt bits, right shifted 1 byte
+    WriteSPIByte2(0b00000000);
+    WriteSPIByte2(0b00000000);
+    WriteSPIByte2(0b00000000);
+    CSBI2_PORT |= CSBI2; // Pull up to end command
+    _delay_us(100);
+
+    // Start voltage sampling
+    CSBI2_PORT &= ~CSBI2;
+    WriteSPIByte2(STCVAD);
+    CSBI2_PORT |= CSBI2;
+
+    _delay_ms(20); // Cell sampling can take up to 16ms - anything we need to do in the meantime? Not really.
+
+    // Start temperature sampling
+    CSBI_PORT &= ~CSBI;
+    WriteSPIByte(STTMPAD);
+    CSBI_PORT |= CSBI;
+
+    // Start temperature sampling, ltc #2
+    CSBI2_PORT &= ~CSBI2;
+    WriteSPIByte2(STTMPAD);
+    CSBI2_PORT |= CSBI2;
+
+    _delay_ms(5); // Temp sampling should only take ~3ms
+
+    // Read cell voltage registers
+    CSBI_PORT &= ~CSBI;
+    WriteSPIByte(RDCV);
+    SDI_PORT |= SDI;
+    for (uint8_t n = 0; n < 25u; n++)
+    {
+        cellBytes[0][n] = ReadSPIByte();
+    }
+    CSBI_PORT |= CSBI;
+    _delay_us(100);
+
+    // Read temperature data
+    CSBI_PORT &= ~CSBI;
+    WriteSPIByte(RDTMP);
+    SDI_PORT |= SDI;
+    for (uint8_t n = 0; n < 5u; n++)
+    {
+        tempBytes[0][n] = ReadSPIByte();
+    }
+    CSBI_PORT |= CSBI;
+    _delay_us(100);
+
+    // Read cell voltage registers, ltc #2
+    CSBI2_PORT &= ~CSBI2;
+    WriteSPIByte2(RDCV);
+    SDI2_PORT |= SDI2;
+    for (uint8_t n = 0; n < 25u; n++)
+    {
+        cellBytes[1][n] = ReadSPIByte2();
+    }
+    CSBI2_PORT |= CSBI2;
+    _delay_us(100);
+
+    // Read temperature data, ltc #2
+    CSBI2_PORT &= ~CSBI2;
+    WriteSPIByte2(RDTMP);
+    SDI2_PORT |= SDI2;
+    for (uint8_t n = 0; n < 5u; n++)
+    {
+        tempBytes[1][n] = ReadSPIByte2();
+    }
+    CSBI2_PORT |= CSBI2;
+    _delay_us(100);
+
+    // Extract voltage data
+    for (uint8_t n = 0; n < 12u; n += 2u)
+    {
+        uint16_t v = cellBytes[1][(n * 3u) / 2u]; // lower byte
+        v += (cellBytes[1][((n * 3u) / 2u) + 1u] & 0x0Fu) << 8; // upper 4 bits
+        v = (v * 3u) / 2u; // mV conversion
+        cells[n] = v;
+        v = (cellBytes[1][((n * 3u) / 2u) + 1u]) >> 4; // lower 4 bits of next cell
+        v += cellBytes[1][((n * 3u) / 2u) + 2u] << 4;  // upper 8 bits
+        v = (v * 3u) / 2u;
+        cells[n + 1u] = v;
+    }
+    for (uint8_t n = 0; n < 12u; n += 2u)
+    {
+        uint16_t v = cellBytes[0][(n * 3u) / 2u]; // lower byte
+        v += (cellBytes[0][((n * 3u) / 2u) + 1u] & 0x0Fu) << 8; // upper 4 bits
+        v = (v * 3u) / 2u; // mV conversion
+        cells[n + 12u] = v;
+        v = (cellBytes[0][((n * 3u) / 2u) + 1u]) >> 4; // lower 4 bits of next cell
+        v += cellBytes[0][((n * 3u) / 2u) + 2u] << 4;  // upper 8 bits
+        v = (v * 3u) / 2u;
+        cells[n + 12u + 1u] = v;
+    }
+
+    // Extract temperature data
+    temps[0] = tempBytes[1][0] + (256u * (tempBytes[1][1] & 0x0Fu)); // gives mV
+    temps[1] = ((uint8_t)(tempBytes[1][1] & 0xF0u) >> 4)
+             + (tempBytes[1][2] * 16u); // gives mV
+    temps[2] = tempBytes[0][0] + (256u * (tempBytes[0][1] & 0x0Fu)); // gives mV
+    temps[3] = ((tempBytes[0][1] & 0xF0u) >> 4) + (tempBytes[0][2] * 16u); // gives mV
+
+    // When moving fast, the average is of at most the last AVG_SAMPLES_FAST
+    // samples before the slow loop, so start the sums again when full
+    if (fastAveraging && (sampleCount >= AVG_SAMPLES_FAST))
+    {
+        for (uint8_t n = 0; n < 24u; n++)
+        {
+            cellSum[n] = 0;
+        }
+        for (uint8_t n = 0; n < 4u; n++)
+        {
+            tempSum[n] = 0;
+        }
+        sampleCount = 0;
+    }
+
+    // Add to the sums for the slow loop averages
+    for (uint8_t n = 0; n < 24u; n++)
+    {
+        cellSum[n] += cells[n] / 2u;
+    }
+    for (uint8_t n = 0; n < 4u; n++)
+    {
+        tempSum[n] += temps[n];
+    }
+    sampleCount++;
+
+    CheckAlarms(cells, temps);
+    SendScope(cells);
+}
+
+// Add the calibration correction to a cell voltage. A voltage of 0 means no
+// cell and is not corrected.
+uint16_t CorrectVoltage(uint8_t cell, uint16_t mv)
+{
+    uint16_t corrected = mv;
+    uint16_t correction = LOW_LTC_CORRECTION;
+    if (cell >= 12u)
+    {
+        correction = HIGH_LTC_CORRECTION;
+    }
+    if (mv > 0u)
+    {
+        corrected += correction;
+        if ((cell == 0u) || (cell == 12u))
+        {
+            corrected -= correction / 2u; // First cells have less drop due to single 3.3Kohm resistor in play
+        }
+    }
+    return corrected;
+}
+
+// Send the cell voltage and temperature replies for one group of cells.
+// Group 0 is the low group (cells 1-12) which uses the module base ID, and
+// group 1 is the high group (cells 13-24) which uses the next ID.
+void SendCellData(uint16_t group)
+{
+    uint16_t baseID = moduleID + (group * 10u);
+    uint16_t cellOffset = group * 12u;
+
+    // Voltage packets
+    // the compiler produces more efficient code when loop indexes
+    // here are uint16_t instead of uint8_t, for some reason
+    for (uint16_t packet = 0; packet < 3u; packet++)
+    {
+        for (uint16_t n = 0; n < 4u; n++)
+        {
+            txData[n * 2u] = voltage[cellOffset + (packet * 4u) + n] >> 8; // Top 8 bits
+            txData[(n * 2u) + 1u] = voltage[cellOffset + (packet * 4u) + n] & 0xFFu; // Bottom 8 bits
+        }
+        (void)CanTX(baseID + packet + 1u, 8);
+        _delay_ms(1); // Brief intermission between packets?
+    }
+
+    // Temperature packet
+    (void)memset(txData, 0, sizeof(txData)); // zero out unused
+    txData[0] = LineariseTemp(temp[group * 2u]);
+    txData[1] = LineariseTemp(temp[(group * 2u) + 1u]);
+    (void)CanTX(baseID + BMS12_REPLY4, 8);
+}
+
+// Check if it is time to send the broadcast reply. The next pass through the
+// main loop is assumed to take as long as the last pass (passTicks), or
+// LOOP_PERIOD_MS if that is longer. If the next pass would reach the reply
+// check after the start of this module's slot, wait here for the slot and
+// return true. If the slot has already started, use the slot in the second
+// round instead, and if that has also started, drop the request.
+bool BroadcastSlotReady(uint16_t passTicks)
+{
+    uint16_t slot = BCAST_GUARD_MS + (((moduleID - BASE_ID) / 10u) * BCAST_SLOT_MS);
+    slot *= CANTIM_TICKS_PER_MS;
+    uint16_t nextPass = LOOP_PERIOD_MS * CANTIM_TICKS_PER_MS;
+    bool ready = false;
+
+    if (passTicks > nextPass)
+    {
+        nextPass = passTicks;
+    }
+
+    cli(); // 16-bit stamp may be updated by ISR
+    uint16_t stamp = broadcastStamp;
+    sei();
+
+    uint16_t elapsed = CANTIM - stamp;
+    if (elapsed > slot) // missed the slot, try the second round
+    {
+        slot += BCAST_SLOTS * BCAST_SLOT_MS * CANTIM_TICKS_PER_MS;
+    }
+
+    if (elapsed > slot)
+    {
+        broadcastRequested = false; // missed both rounds, give up
+    }
+    else if ((elapsed + nextPass) >= slot)
+    {
+        // Wait for start of slot. This is at most one pass, but is also
+        // limited by a count of 100us polls in case the CAN timer stops.
+        uint16_t polls = ((slot - elapsed) / (CANTIM_TICKS_PER_MS / 10u)) + 1u;
+        while (((uint16_t)(CANTIM - stamp) < slot) && (polls != 0u))
+        {
+            _delay_us(100);
+            polls--;
+            wdt_reset();
+        }
+        ready = true;
+    }
+    else
+    {} // slot is after the next pass
+    return ready;
+}
 
-    if (USE_29BIT_IDS != 0u) // CAN 2.0b is 29-bit IDs, CANIDT4 has bits 0-4 in top 5 bits, CANID3 has 5-12
+// Update the cell statistics from the latest averaged cell voltages.
+// This is called from the slow loop each time a new average is taken, so
+// each average is counted once whatever the sample rate. The history is timed
+// in slow loops, using the number of slow loops since the last average.
+// Cells reading 0 are not connected and are not included.
+void UpdateStats(uint8_t loops)
+{
+    static uint8_t historyTimer = 0;
+
+    historyTimer += loops;
+    bool takeSnapshot = (historyTimer >= HISTORY_INTERVAL);
+    if (takeSnapshot)
     {
-        CANIDT1 = packetID >> 21;
-        CANIDT2 = packetID >> 13;
-        CANIDT3 = packetID >> 5;
-        CANIDT4 = (packetID & 0b00011111u) << 3u;
+        historyTimer = 0;
     }
-    else // CAN 2.0a is 11-bit IDs, IDT1 has top 8 bits, IDT2 has bottom three bits BUT at top of byte!
+
+    for (uint16_t group = 0; group < 2u; group++)
     {
-        CANIDT1 = (packetID >> 3u); // Packet ID
-        CANIDT2 = (packetID & 0x07u) << 5;
-        CANIDT3 = 0x00;
-        CANIDT4 = 0x00;
+        snapshot_t snap = { 0xFFFFu, 0, 0, 0 };
+
+        for (uint16_t n = group * 12u; n < ((group * 12u) + 12u); n++)
+        {
+            uint16_t v = voltage[n];
+            if (v > 0u)
+            {
+                if (v < cellMin[n]) { cellMin[n] = v; }
+                if (v > cellMax[n]) { cellMax[n] = v; }
+
+                // counts saturate instead of rolling over, and a limit of 0
+                // is not checked
+                if ((cellOverLimit != 0u) && (v > cellOverLimit)
+                 && (overCount[group] != 0xFFFFu))
+                {
+                    overCount[group]++;
+                }
+                if ((v < cellUnderLimit) && (underCount[group] != 0xFFFFu))
+                {
+                    underCount[group]++;
+                }
+                UpdateCellCounts((uint8_t)n, v);
+
+                uint8_t cellNum = (uint8_t)(n - (group * 12u)) + 1u;
+                if (v < snap.min) { snap.min = v; snap.minCell = cellNum; }
+                if (v > snap.max) { snap.max = v; snap.maxCell = cellNum; }
+            }
+        }
+
+        if (takeSnapshot)
+        {
+            if (snap.max == 0u)
+            {
+                snap.min = 0; // no cells, report all zeroes
+            }
+            history[group][historyHead] = snap;
+            if (historyCount[group] < HISTORY_DEPTH)
+            {
+                historyCount[group]++;
+            }
+        }
     }
 
-    for (uint8_t i = 0; i < bytes; i++)
+    if (takeSnapshot)
     {
-        CANMSG = txData[i];
+        historyHead = (historyHead + 1u) % HISTORY_DEPTH;
     }
+}
 
-    // Enable transmission, 8-bit data
-    CANCDMOB = (1u << CONMOB0) | (bytes << DLC0) | ((1u << IDE) * USE_29BIT_IDS);
+// Count the times one cell goes over or under the limits. A cell is counted
+// when it crosses a limit, and must come back inside the limit by the alarm
+// hysteresis before it is counted again. Counts saturate at 255.
+void UpdateCellCounts(uint8_t cell, uint16_t mv)
+{
+    uint32_t mask = 1UL << cell;
 
-    while (!(CANSTMOB & (1 << TXOK)) && !(CANSTMOB & (1 << AERR)))
-    {} // Wait for transmission to finish (via setting of TXOK flag)
+    if ((cellOverLimit != 0u) && (mv > cellOverLimit))
+    {
+        if (((cellsOver & mask) == 0u) && (cellOverCount[cell] != 0xFFu))
+        {
+            cellOverCount[cell]++;
+        }
+        cellsOver |= mask;
+    }
+    else if ((mv + ALARM_HYST_MV) < cellOverLimit)
+    {
+        cellsOver &= ~mask;
+    }
+    else
+    {} // inside hysteresis, no change
+
+    if (mv < cellUnderLimit)
+    {
+        if (((cellsUnder & mask) == 0u) && (cellUnderCount[cell] != 0xFFu))
+        {
+            cellUnderCount[cell]++;
+        }
+        cellsUnder |= mask;
+    }
+    else if (mv > (cellUnderLimit + ALARM_HYST_MV))
+    {
+        cellsUnder &= ~mask;
+    }
+    else
+    {} // inside hysteresis, no change
+}
 
-    CANCDMOB = 0x00; // Disable transmission
-    CANSTMOB = 0x00; // Clear TXOK flag
+// Clear the statistics and history for one group of cells
+void ClearStats(uint16_t group)
+{
+    for (uint16_t n = group * 12u; n < ((group * 12u) + 12u); n++)
+    {
+        cellMin[n] = 0xFFFFu;
+        cellMax[n] = 0;
+        cellOverCount[n] = 0;
+        cellUnderCount[n] = 0;
+    }
+    cellsOver &= ~(0x0FFFUL << (group * 12u));
+    cellsUnder &= ~(0x0FFFUL << (group * 12u));
+    overCount[group] = 0;
+    underCount[group] = 0;
+    historyCount[group] = 0;
+}
+
+// Send the statistics for one group of cells as a sequence of Response
+// messages. The first message has the over/under limit counts, then there
+// is one message per cell with the min and max voltage.
+void SendStats(uint16_t group)
+{
+    uint32_t respID = moduleID + (group * 10u) + RESP_ID;
+
+    txData[0] = CMD_STATS;
+    txData[1] = 0; // sequence 0 is the counts
+    txData[2] = overCount[group] >> 8;
+    txData[3] = overCount[group] & 0xFFu;
+    txData[4] = underCount[group] >> 8;
+    txData[5] = underCount[group] & 0xFFu;
+    (void)CanTX(respID, 6);
+
+    for (uint16_t n = 0; n < 12u; n++)
+    {
+        uint16_t cell = (group * 12u) + n;
+        _delay_ms(1); // Brief intermission between packets
+        txData[1] = n + 1u; // sequence 1-12 is the cell number
+        txData[2] = cellMin[cell] >> 8;
+        txData[3] = cellMin[cell] & 0xFFu;
+        txData[4] = cellMax[cell] >> 8;
+        txData[5] = cellMax[cell] & 0xFFu;
+        txData[6] = cellOverCount[cell];
+        txData[7] = cellUnderCount[cell];
+        (void)CanTX(respID, 8);
+    }
+}
+
+// Send the history snapshots for one group of cells as a sequence of
+// Response messages, newest first. The first message has the number of
+// snapshots that follow.
+void SendHistory(uint16_t group)
+{
+    uint32_t respID = moduleID + (group * 10u) + RESP_ID;
+    uint8_t count = historyCount[group];
+    uint8_t idx = historyHead;
+
+    txData[0] = CMD_HISTORY;
+    txData[1] = count; // first message has the number of snapshots to follow
+    (void)CanTX(respID, 2);
+
+    for (uint8_t n = 0; n < count; n++)
+    {
+        idx = (idx + HISTORY_DEPTH - 1u) % HISTORY_DEPTH; // step back in ring
+        _delay_ms(1); // Brief intermission between packets
+        txData[1] = n + 1u; // sequence 1 is newest
+        txData[2] = history[group][idx].minCell;
+        txData[3] = history[group][idx].min >> 8;
+        txData[4] = history[group][idx].min & 0xFFu;
+        txData[5] = history[group][idx].maxCell;
+        txData[6] = history[group][idx].max >> 8;
+        txData[7] = history[group][idx].max & 0xFFu;
+        (void)CanTX(respID, 8);
+    }
+}
+
+// Set the cell voltage and temperature limits from the command data.
+// The limits apply to the whole module, and are also used for the over/under
+// counts in the cell statistics. Any alarms that are active are cleared so
+// they will be reported again against the new limits, and the over/under
+// counts are cleared because they were counted against the old limits.
+// The limits are kept inside the range where the alarm clear level (the
+// limit with hysteresis) cannot wrap.
+void SetLimits(void)
+{
+    cellOverLimit = (cmdData[0] << 8) + cmdData[1];
+    cellUnderLimit = (cmdData[2] << 8) + cmdData[3];
+    overTempLimit = cmdData[4];
+    alarmsEnabled = (cmdData[5] != 0u);
+    if ((cellOverLimit != 0u) && (cellOverLimit < ALARM_HYST_MV))
+    {
+        cellOverLimit = ALARM_HYST_MV;
+    }
+    if (cellUnderLimit > (0xFFFFu - ALARM_HYST_MV))
+    {
+        cellUnderLimit = 0xFFFFu - ALARM_HYST_MV;
+    }
+    if ((overTempLimit != 0u) && (overTempLimit < ALARM_HYST_TEMP))
+    {
+        overTempLimit = ALARM_HYST_TEMP;
+    }
+    overVoltAlarms = 0;
+    underVoltAlarms = 0;
+    overTempAlarms = 0;
+    for (uint8_t group = 0; group < 2u; group++)
+    {
+        overCount[group] = 0;
+        underCount[group] = 0;
+    }
+    for (uint8_t n = 0; n < 24u; n++)
+    {
+        cellOverCount[n] = 0;
+        cellUnderCount[n] = 0;
+    }
+    cellsOver = 0;
+    cellsUnder = 0;
+}
+
+// Check the latest sample of each cell and temp sensor against the limits
+// and send an alarm message as soon as a limit is crossed, or when it comes
+// back inside the limit (with hysteresis). The number of alarm messages per
+// sample period is limited. Any that are not sent are picked up on the next
+// sample, because the alarm state only changes when the message is sent.
+void CheckAlarms(const uint16_t cells[24], const uint16_t temps[4])
+{
+    alarmsSent = 0;
+
+    for (uint8_t n = 0; (n < 24u) && alarmsEnabled; n++)
+    {
+        uint16_t v = cells[n];
+        uint32_t mask = 1UL << n;
+
+        // 0 or out of range means no cell, see slow loop
+        if ((v > 0u) && (v <= 5000u))
+        {
+            v = CorrectVoltage(n, v); // same as the reported voltage
+
+            bool active = ((overVoltAlarms & mask) != 0u);
+            if ((cellOverLimit != 0u)
+             && ((!active && (v > cellOverLimit))
+              || (active && (v < (cellOverLimit - ALARM_HYST_MV)))))
+            {
+                if (SendAlarm(ALARM_OVER_VOLTAGE, n, v, !active))
+                {
+                    overVoltAlarms ^= mask;
+                }
+            }
+
+            active = ((underVoltAlarms & mask) != 0u);
+            if ((cellUnderLimit != 0u)
+             && ((!active && (v < cellUnderLimit))
+              || (active && (v > (cellUnderLimit + ALARM_HYST_MV)))))
+            {
+                if (SendAlarm(ALARM_UNDER_VOLTAGE, n, v, !active))
+                {
+                    underVoltAlarms ^= mask;
+                }
+            }
+        }
+    }
+
+    for (uint8_t n = 0; (n < 4u) && alarmsEnabled && (overTempLimit != 0u); n++)
+    {
+        // unconnected sensor reads as 0 so will not alarm
+        uint16_t t = LineariseTemp(temps[n]);
+        uint8_t mask = 1u << n;
+        bool active = ((overTempAlarms & mask) != 0u);
+        if ((!active && (t > overTempLimit))
+         || (active && (t < (overTempLimit - ALARM_HYST_TEMP))))
+        {
+            if (SendAlarm(ALARM_OVER_TEMP, n, t, !active))
+            {
+                overTempAlarms ^= mask;
+            }
+        }
+    }
+}
+
+// Send an alarm message, unless the limit of alarm messages for this sample
+// period has been reached. Returns true if the message was sent on the bus.
+// A message that is dropped by CanTX() still counts against the limit,
+// because the limit is what keeps a sample period inside the watchdog time
+// when every frame times out. It is tried again on the next sample.
+bool SendAlarm(uint8_t type, uint8_t index, uint16_t value, bool active)
+{
+    bool sent = false;
+    if (alarmsSent < ALARM_MAX_PER_LOOP)
+    {
+        alarmsSent++;
+        txData[0] = type;
+        txData[1] = index + 1u; // cell or sensor number, 1-origin
+        txData[2] = value >> 8;
+        txData[3] = value & 0xFFu;
+        txData[4] = active ? 1u : 0u;
+        sent = CanTX(ALARM_BASE_ID + ((moduleID - BASE_ID) / 10u), 5);
+    }
+    return sent;
+}
+
+// Adjust the sample rate and averaging according to how fast the cell
+// voltages are changing. This is called from the slow loop each time a new
+// average is taken, with the largest change of any cell per slow loop. When
+// cells are moving fast, go straight to the fastest rate and average every
+// slow loop, over at most the last AVG_SAMPLES_FAST samples. When they are at rest for a while, step the rate down towards
+// the slowest rate and average AVG_SAMPLES_REST samples, which may take
+// several slow loops.
+void UpdateSampleRate(uint16_t maxDelta)
+{
+    static uint8_t restLoops = 0;
+
+    cellDeltaMax = maxDelta;
+    if (maxDelta >= RATE_FAST_MV)
+    {
+        restLoops = 0;
+        sampleDiv = rateDivFast;
+        fastAveraging = true;
+    }
+    else if (maxDelta <= RATE_REST_MV)
+    {
+        restLoops++;
+        if (restLoops >= RATE_REST_LOOPS)
+        {
+            restLoops = 0;
+            sampleDiv *= 2u;
+            fastAveraging = false;
+        }
+    }
+    else
+    {
+        restLoops = 0;
+    }
+
+    // keep inside configured rates, which may have changed
+    if (sampleDiv > rateDivSlow)
+    {
+        sampleDiv = rateDivSlow;
+    }
+    if (sampleDiv < rateDivFast)
+    {
+        sampleDiv = rateDivFast;
+    }
+
+    // scope capture always uses the full rate
+    if (scopeCells != 0u)
+    {
+        sampleDiv = 1u;
+    }
+}
+
+// Start or stop a scope capture for one group of cells, from the command
+// data. The cells of the other group are not changed. Starting a capture sets
+// the capture time for both groups, but stopping one group leaves the time
+// running for the other.
+// The selection is trimmed so the samples of both groups fit in
+// SCOPE_MAX_FRAMES messages. The messages used by the other group are left
+// for it, and the lowest numbered cells of this group are kept. Returns the
+// cells accepted for this group.
+uint16_t SetScope(uint16_t group)
+{
+    uint16_t select = ((uint16_t)cmdData[0] << 8) + cmdData[1];
+    uint16_t other = (scopeCells >> ((1u - group) * 12u)) & 0x0FFFu;
+    uint8_t otherCells = 0;
+
+    for (uint8_t n = 0; n < 12u; n++)
+    {
+        if ((other & (1u << n)) != 0u)
+        {
+            otherCells++;
+        }
+    }
+    // cells left for this group, in whole messages
+    uint8_t allowed = (SCOPE_MAX_FRAMES - ((otherCells + 2u) / 3u)) * 3u;
+
+    uint16_t accepted = 0;
+    for (uint8_t n = 0; n < 12u; n++)
+    {
+        if (((select & (1u << n)) != 0u) && (allowed != 0u))
+        {
+            accepted |= (1u << n);
+            allowed--;
+        }
+    }
+
+    uint32_t cells = (uint32_t)accepted << (group * 12u);
+    scopeCells &= ~(0x0FFFUL << (group * 12u));
+    if ((cmdData[2] != 0u) && (cells != 0u))
+    {
+        scopeCells |= cells;
+        scopeTimer = cmdData[2] * BASE_RATE_HZ; // seconds to main loops
+    }
+    if (scopeCells == 0u)
+    {
+        scopeTimer = 0;
+    }
+    else
+    {
+        sampleDiv = 1u; // start at full rate now
+    }
+    return (uint16_t)(scopeCells >> (group * 12u)) & 0x0FFFu;
+}
+
+// Send the latest raw sample of each cell selected for scope capture. These
+// are the voltages before averaging and correction. The samples are packed
+// 3 to a message, in cell order, and all messages for one sample have the
+// same sequence number. SetScope() limits the selection so this is at most
+// SCOPE_MAX_FRAMES messages.
+void SendScope(const uint16_t cells[24])
+{
+    // Samples are not sent while waiting for a broadcast reply slot, which
+    // shows as a gap in the sequence numbers
+    if ((scopeCells != 0u) && (!broadcastRequested))
+    {
+        for (uint16_t group = 0; group < 2u; group++)
+        {
+            uint32_t scopeID = moduleID + (group * 10u) + SCOPE_ID;
+            uint8_t count = 0;
+            for (uint8_t n = 0; n < 12u; n++)
+            {
+                uint8_t cell = (group * 12u) + n;
+                if ((scopeCells & (1UL << cell)) != 0u)
+                {
+                    if (count == 0u)
+                    {
+                        txData[0] = scopeSeq;
+                        txData[1] = n + 1u; // cell number of first sample
+                    }
+                    txData[2u + (count * 2u)] = cells[cell] >> 8;
+                    txData[3u + (count * 2u)] = cells[cell] & 0xFFu;
+                    count++;
+                    if (count == 3u)
+                    {
+                        (void)CanTX(scopeID, 8);
+                        count = 0;
+                    }
+                }
+            }
+            if (count != 0u) // partly filled message
+            {
+                (void)CanTX(scopeID, 2u + (count * 2u));
+            }
+        }
+        scopeSeq++;
+    }
+    else if (scopeCells != 0u)
+    {
+        scopeSeq++; // skipped sample
+    }
+    else
+    {} // no capture
+}
+
+// Set the fastest and slowest sample rate from the command data, in Hz.
+// A rate of 0 leaves that setting unchanged. The rate is rounded to the
+// nearest rate that is possible.
+void SetSampleRate(void)
+{
+    uint8_t fastHz = cmdData[0];
+    uint8_t slowHz = cmdData[1];
+
+    if (fastHz != 0u)
+    {
+        rateDivFast = (BASE_RATE_HZ + (fastHz / 2u)) / fastHz;
+    }
+    if (slowHz != 0u)
+    {
+        rateDivSlow = (BASE_RATE_HZ + (slowHz / 2u)) / slowHz;
+    }
+
+    if (rateDivFast < 1u) { rateDivFast = 1u; }
+    if (rateDivFast > RATE_DIV_MAX) { rateDivFast = RATE_DIV_MAX; }
+    if (rateDivSlow > RATE_DIV_MAX) { rateDivSlow = RATE_DIV_MAX; }
+    if (rateDivSlow < rateDivFast) { rateDivSlow = rateDivFast; }
+}
+
+// Count the time each cell shunt is on. This is called from the slow loop
+// with the new shunt bits, which stay in effect until the next slow loop.
+void UpdateBalance(uint32_t shuntBits)
+{
+    static uint8_t prescale = 0;
+
+    for (uint8_t n = 0; n < 24u; n++)
+    {
+        // the voltage sum stops with the time so they stay consistent
+        if (((shuntBits & (1UL << n)) != 0u) && (shuntSecs[n] != 0xFFFFu))
+        {
+            shuntMVLoops[n] += voltage[n];
+            shuntLoops[n]++;
+            if (shuntLoops[n] >= SLOW_LOOPS_PER_SEC)
+            {
+                shuntLoops[n] = 0;
+                shuntSecs[n]++;
+            }
+        }
+    }
+
+    prescale++;
+    if (prescale >= SLOW_LOOPS_PER_SEC)
+    {
+        prescale = 0;
+        for (uint8_t group = 0; group < 2u; group++)
+        {
+            if (balanceSecs[group] != 0xFFFFu)
+            {
+                balanceSecs[group]++;
+            }
+        }
+    }
+}
+
+// Clear the balancing counters for one group of cells
+void ClearBalance(uint16_t group)
+{
+    for (uint16_t n = group * 12u; n < ((group * 12u) + 12u); n++)
+    {
+        shuntSecs[n] = 0;
+        shuntLoops[n] = 0;
+        shuntMVLoops[n] = 0;
+    }
+    balanceSecs[group] = 0;
+}
+
+// Send the balancing counters for one group of cells as a sequence of
+// Response messages. The first message has the time since the counters were
+// cleared, then there is one message per cell with the shunt on time and the
+// estimated bleed charge. The charge is the cell voltage integrated over the
+// shunt on time, divided by the shunt resistance.
+void SendBalance(uint16_t group)
+{
+    uint32_t respID = moduleID + (group * 10u) + RESP_ID;
+
+    txData[0] = CMD_BALANCE;
+    txData[1] = 0; // sequence 0 is the elapsed time
+    txData[2] = balanceSecs[group] >> 8;
+    txData[3] = balanceSecs[group] & 0xFFu;
+    (void)CanTX(respID, 4);
+
+    for (uint16_t n = 0; n < 12u; n++)
+    {
+        uint16_t cell = (group * 12u) + n;
+        uint32_t charge = shuntMVLoops[cell] / SHUNT_OHMS; // mA slow loops
+        charge /= SLOW_LOOPS_PER_01MAH;
+        if (charge > 0xFFFFu)
+        {
+            charge = 0xFFFFu;
+        }
+        _delay_ms(1); // Brief intermission between packets
+        txData[1] = n + 1u; // sequence 1-12 is the cell number
+        txData[2] = shuntSecs[cell] >> 8;
+        txData[3] = shuntSecs[cell] & 0xFFu;
+        txData[4] = charge >> 8;
+        txData[5] = charge & 0xFFu;
+        (void)CanTX(respID, 6);
+    }
+}
+
+// Check for CAN bus-off, and recover from it in a controlled way. When the
+// controller goes bus-off, transmit is stopped, and after a holdoff time the
+// CAN controller is reset and enabled again.
+// Error-passive is only counted. The controller still sends and receives
+// while error-passive, and leaves it on its own as the error counters drop,
+// so there is nothing to recover.
+void CanCheckBus(void)
+{
+    static uint8_t holdoff = 0;
+    static bool errPassive = false;
+
+    if ((CANGSTA & (1u << ERRP)) != 0u)
+    {
+        if ((!errPassive) && (canErrPassiveCount != 0xFFu))
+        {
+            canErrPassiveCount++;
+        }
+        errPassive = true;
+    }
+    else
+    {
+        errPassive = false;
+    }
+
+    // bus-off interrupt flag is latched, so bus-off is seen even if the
+    // controller has already recovered on its own. Write 1 to clear.
+    if (((CANGIT & (1u << BOFFIT)) != 0u) || ((CANGSTA & (1u << BOFF)) != 0u))
+    {
+        CANGIT = (1u << BOFFIT);
+        if (!canBusOff)
+        {
+            canBusOff = true;
+            if (canBusOffCount != 0xFFu)
+            {
+                canBusOffCount++;
+            }
+        }
+        holdoff = CAN_BUSOFF_HOLDOFF;
+    }
+    else if (canBusOff)
+    {
+        if (holdoff != 0u)
+        {
+            holdoff--;
+        }
+        else
+        {
+            // CanInit() resets the CAN timer, so a pending broadcast
+            // request has lost its time stamp and has to be dropped
+            cli();
+            CanInit();
+            broadcastRequested = false;
+            sei();
+            canBusOff = false;
+        }
+    }
+    else
+    {} // bus is ok
+}
+
+// Transmit a CAN frame using MOB0. This will not wait forever. If the frame
+// cannot be sent because the bus is off, or it is not acknowledged, or it
+// times out, then it is dropped and counted. Returns true if the frame was
+// sent.
+bool CanTX(uint32_t packetID, uint8_t bytes)
+{
+    uint16_t polls = CAN_TX_POLLS;
+    uint8_t status = 0;
+
+    CANPAGE = 0x00; // Select MOB0 for transmission
+    while ((!canBusOff) && ((CANEN2 & (1 << ENMOB0)) != 0) && (polls != 0u))
+    {
+        _delay_us(CAN_TX_POLL_US); // Wait for MOB0 to be free
+        polls--;
+    }
+
+    if ((!canBusOff) && ((CANEN2 & (1 << ENMOB0)) == 0))
+    {
+        CANSTMOB = 0x00;
+
+        if (USE_29BIT_IDS != 0u) // CAN 2.0b is 29-bit IDs, CANIDT4 has bits 0-4 in top 5 bits, CANID3 has 5-12
+        {
+            CANIDT1 = packetID >> 21;
+            CANIDT2 = packetID >> 13;
+            CANIDT3 = packetID >> 5;
+            CANIDT4 = (packetID & 0b00011111u) << 3u;
+        }
+        else // CAN 2.0a is 11-bit IDs, IDT1 has top 8 bits, IDT2 has bottom three bits BUT at top of byte!
+        {
+            CANIDT1 = (packetID >> 3u); // Packet ID
+            CANIDT2 = (packetID & 0x07u) << 5;
+            CANIDT3 = 0x00;
+            CANIDT4 = 0x00;
+        }
+
+        for (uint8_t i = 0; i < bytes; i++)
+        {
+            CANMSG = txData[i];
+        }
+
+        // Enable transmission, 8-bit data
+        CANCDMOB = (1u << CONMOB0) | (bytes << DLC0) | ((1u << IDE) * USE_29BIT_IDS);
+
+        // Wait for transmission to finish (via setting of TXOK flag), or
+        // no acknowledge, or timeout
+        polls = CAN_TX_POLLS;
+        status = CANSTMOB;
+        while (((status & ((1u << TXOK) | (1u << AERR))) == 0u) && (polls != 0u))
+        {
+            _delay_us(CAN_TX_POLL_US);
+            polls--;
+            status = CANSTMOB;
+        }
+
+        CANCDMOB = 0x00; // Disable transmission, aborts if not sent
+        CANSTMOB = 0x00; // Clear TXOK flag
+    }
+
+    bool sent = ((status & (1u << TXOK)) != 0u);
+    if ((!sent) && (canDropped != 0xFFFFu))
+    {
+        canDropped++;
+    }
+    return sent;
 }
 
 // Function to convert ADC level to temperature. From datasheet for Epcos 100Kohm NTC B25/100 of 4540 K
@@ -559,7 +1721,8 @@ void CanTX(uint32_t packetID, uint8_t bytes)
 
 int LineariseTemp(uint16_t adc)
 {
-    static const uint16_t tempData[21] =
+    // kept in flash to save 42 bytes of RAM
+    static const uint16_t tempData[21] PROGMEM =
     { 1987, 1946, 1876, 1763, 1599, 1386, 1140, 890, 668, 492,
       352, 249, 176, 126, 91, 65, 48, 36, 28, 20, 16
     };
@@ -571,10 +1734,12 @@ int LineariseTemp(uint16_t adc)
     {
         for (uint8_t n = 0; n < 20u; n++)
         {
-            if ((adc <= tempData[n]) && (adc > tempData[n + 1u])) // We're between samples
+            uint16_t tempHi = pgm_read_word(&tempData[n]);
+            uint16_t tempLo = pgm_read_word(&tempData[n + 1u]);
+            if ((adc <= tempHi) && (adc > tempLo)) // We're between samples
             {
                 // Calculate linear interpolation
-                ret = (n * 10u) + ((10u * (adc - tempData[n])) / (tempData[n + 1u] - tempData[n]));
+                ret = (n * 10u) + ((10u * (adc - tempHi)) / (tempLo - tempHi));
             }
         }
     }
@@ -594,9 +1759,14 @@ void SetupPorts(void)
     PORTC = 0b00000000;
     PORTD = 0b11100000;
 
+    CanInit();
+}
+
+void CanInit(void)
+{
     // CAN init stuff. Further info on page 203 of ATmega16M1 manual
     CANGCON = (1<<SWRES); // Software reset
-    CANTCON = 0; // CAN timing prescaler set to 0
+    CANTCON = CANTIM_PRESCALE; // CAN timer prescaler, used for reply slots
 
     if (CAN_BAUD_RATE == 1000)
     {
@@ -0,0 +1,86 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2026 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <stdint.h>
+
+#include "stackmon.h"
+
+// pattern used to fill unused RAM. If this is changed, it must also be
+// changed in the StackPaint() assembly code below
+#define STACK_CANARY 0xC5u
+
+// Symbols provided by the linker. There is no heap so free RAM runs from
+// _end up to __stack (RAMEND)
+extern uint8_t __data_start;
+extern uint8_t _end;
+extern uint8_t __stack;
+
+// The paint function runs from .init1, which is before the stack pointer and
+// the zero register are set up, so it is naked and cannot use the stack.
+// That is also why it is in assembly. It is "used" so it is not removed by
+// LTO or section garbage collection, since nothing calls it.
+void StackPaint(void) __attribute__((naked, used, section(".init1")));
+
+void StackPaint(void)
+{
+    __asm volatile ("    ldi r30,lo8(_end)\n"
+                    "    ldi r31,hi8(_end)\n"
+                    "    ldi r24,lo8(0xc5)\n"     // STACK_CANARY
+                    "    ldi r25,hi8(__stack)\n"
+                    "    rjmp 2f\n"
+                    "1:\n"
+                    "    st Z+,r24\n"
+                    "2:\n"
+                    "    cpi r30,lo8(__stack)\n"
+                    "    cpc r31,r25\n"
+                    "    brlo 1b\n"
+                    "    breq 1b"::);
+}
+
+uint16_t StackMonStaticSize(void)
+{
+    // cppcheck-suppress misra-c2012-18.2
+    return (uint16_t)(&_end - &__data_start);
+}
+
+uint16_t StackMonUnused(void)
+{
+    const uint8_t *p = &_end;
+    uint16_t count = 0;
+
+    // cppcheck-suppress misra-c2012-18.3
+    while ((p <= &__stack) && (*p == STACK_CANARY))
+    {
+        p++;
+        count++;
+    }
+    return count;
+}
+
+uint16_t StackMonMaxDepth(void)
+{
+    // cppcheck-suppress misra-c2012-18.2
+    uint16_t freeRam = (uint16_t)(&__stack - &_end) + 1u;
+    return freeRam - StackMonUnused();
+}
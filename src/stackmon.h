@@ -0,0 +1,59 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2026 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef STACKMON_H
+#define STACKMON_H
+
+/** @addtogroup stackmon Stack Monitor
+ *
+ * The RAM between the end of static variables and the top of the stack is
+ * filled with a known pattern at startup, before main() runs. Scanning for
+ * the pattern shows how deep the stack (including interrupts) has ever grown.
+ *
+ * @{
+ */
+
+/**
+ * Size of static RAM, in bytes.
+ *
+ * This is the RAM used by initialized and zeroed static variables
+ * (.data and .bss).
+ */
+extern uint16_t StackMonStaticSize(void);
+
+/**
+ * Deepest stack use since reset, in bytes.
+ */
+extern uint16_t StackMonMaxDepth(void);
+
+/**
+ * RAM that has never been used since reset, in bytes.
+ *
+ * This is the headroom between static variables and the deepest stack use.
+ */
+extern uint16_t StackMonUnused(void);
+
+#endif
+
+/** @} */